@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "twiboot.h"
+
+/*
+ * Flashes a raw binary image to a twiboot device from a Linux machine.
+ *
+ * Usage: twiboot-flash <bus> <address> <image.bin>
+ *   e.g. twiboot-flash /dev/i2c-1 0x29 firmware.bin
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <bus> <address> <image.bin>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[3], "rb");
+    if (file == nullptr)
+    {
+        perror(argv[3]);
+        return 1;
+    }
+
+    static uint8_t prog[0x10000];
+    int len = fread(prog, 1, sizeof(prog), file);
+    fclose(file);
+
+    TwibootLinuxTransport bus(argv[1]);
+    Twiboot twiboot(&bus, strtol(argv[2], nullptr, 0)); // Initiallize a twiboot object on the bus
+
+    if (!twiboot.Init())
+    {
+        fprintf(stderr, "Could not reach the bootloader!\n");
+        return 1;
+    }
+
+    printf("Flashing...\n");
+    if (!twiboot.WriteFlash(prog, len) || !twiboot.Verify(prog, len))
+    {
+        fprintf(stderr, "Flashing failed!\n");
+        return 1;
+    }
+
+    printf("Flashed and verified, going to the app now!\n");
+    twiboot.Exit();
+
+    return 0;
+}
@@ -84,19 +84,29 @@ unsigned char prog[924] = {
     0x80, 0xE0, 0x0E, 0x94, 0x70, 0x00, 0x0E, 0x94, 0xDD, 0x00, 0x20, 0x97,
     0xA1, 0xF3, 0x0E, 0x94, 0x00, 0x00, 0xF1, 0xCF, 0xF8, 0x94, 0xFF, 0xCF};
 
-Twiboot twiboot; // Initiallize a twiboot object
+Twiboot twiboot(0x29, D2); // Initiallize a twiboot object, with the device's RESET line wired to D2
+bool flashed = false;      // Whether the device has already been flashed
 
 void setup()
 {
     Serial.begin(9600);
+    twiboot.SetManifestOffset(0); // remember what was flashed, so only changed pages are sent next time
 }
 
 void loop()
 {
-    while (!twiboot.Init()) // wait for the bootloader to properly initialize
-        ;
+    if (flashed) // the device would be reset back into the bootloader otherwise
+        return;
 
-    Serial.println("Bootloader initialized!");
+    if (!twiboot.EnterBootloader()) // reset the device into the bootloader
+    {
+        Serial.println("Could not enter the bootloader! Trying again...");
+        return;
+    }
+
+    Serial.print("Bootloader initialized in ");
+    Serial.print(twiboot.GetEntryLatency());
+    Serial.println("ms!");
 
     char btldr_ver[16];
     twiboot.GetBootloaderVersion(btldr_ver);
@@ -122,9 +132,16 @@ void loop()
 
     Serial.println("Flashing...");
 
-    twiboot.WriteFlash(prog, sizeof(prog)); // flash the program
+    int pagesWritten;
+    if (!twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &pagesWritten)) // flash the pages of the program that changed
+    {
+        Serial.println("Flashing failed! Trying again...");
+        return;
+    }
 
-    Serial.println("Flashed!");
+    Serial.print("Flashed ");
+    Serial.print(pagesWritten);
+    Serial.println(" pages!");
 
     Serial.println("Verifying...");
     if (twiboot.Verify(prog, sizeof(prog))) // verify the program
@@ -132,10 +149,12 @@ void loop()
         Serial.println("Verified!");
         Serial.println("All done, going to the app now!");
 
-        twiboot.Exit();
+        twiboot.BootApp();
+        flashed = true;
     }
     else
     {
         Serial.println("Verification failed! Trying again...");
+        twiboot.ClearManifest(); // the device doesn't hold what was recorded, so read it back next time
     }
 }
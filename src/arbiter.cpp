@@ -0,0 +1,181 @@
+#include "arbiter.h"
+
+TwibootArbiter::TwibootArbiter(TwibootTransport *transport, uint32_t bulkSliceMs)
+{
+    this->transport = transport;
+    this->slice_ms = bulkSliceMs;
+    this->busy = false;
+    this->held_since = 0;
+
+    for (int i = 0; i < TWIBOOT_PRIORITY_COUNT; i++)
+    {
+        next_ticket[i] = 0;
+        serving[i] = 0;
+    }
+
+    ResetStats();
+}
+
+bool TwibootArbiter::urgentWaiting(TwibootPriority priority)
+{
+    for (int i = 0; i < priority; i++)
+    {
+        if (next_ticket[i] != serving[i])
+            return true;
+    }
+
+    return false;
+}
+
+bool TwibootArbiter::anyWaiting()
+{
+    return urgentWaiting(TWIBOOT_PRIORITY_COUNT);
+}
+
+void TwibootArbiter::Acquire(TwibootPriority priority)
+{
+    uint32_t start = twibootMicros();
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Take the bus when it is free, nobody more urgent wants it, and everyone of the same
+    // priority who asked earlier has had it. A holder that gives the bus up and asks again
+    // therefore goes to the back of its class.
+    uint32_t ticket = next_ticket[priority]++;
+#if defined(PARTICLE)
+    // Device OS does not reliably provide condition variables, so poll instead.
+    while (busy || urgentWaiting(priority) || serving[priority] != ticket)
+    {
+        lock.unlock();
+        twibootDelay(1);
+        lock.lock();
+    }
+#else
+    released.wait(lock, [&]
+                  { return !busy && !urgentWaiting(priority) && serving[priority] == ticket; });
+#endif
+
+    serving[priority]++;
+    busy = true;
+    held_since = twibootMillis();
+
+    uint32_t waited = twibootMicros() - start;
+    stats[priority].count++;
+    stats[priority].total_us += waited;
+    if (waited > stats[priority].max_us)
+        stats[priority].max_us = waited;
+}
+
+void TwibootArbiter::Release()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = false;
+    }
+
+#if !defined(PARTICLE)
+    released.notify_all();
+#endif
+}
+
+bool TwibootArbiter::Preempted(TwibootPriority priority)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (urgentWaiting(priority))
+        return true;
+
+    return priority == TWIBOOT_PRIORITY_BULK && twibootMillis() - held_since >= slice_ms && anyWaiting();
+}
+
+void TwibootArbiter::GetStats(TwibootPriority priority, TwibootWaitStats *stats)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    *stats = this->stats[priority];
+}
+
+void TwibootArbiter::ResetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (int i = 0; i < TWIBOOT_PRIORITY_COUNT; i++)
+    {
+        stats[i] = {0, 0, 0};
+    }
+}
+
+TwibootArbiterClient::TwibootArbiterClient(TwibootArbiter *arbiter, TwibootPriority priority)
+{
+    this->arbiter = arbiter;
+    this->priority = priority;
+    this->depth = 0;
+}
+
+bool TwibootArbiterClient::Begin()
+{
+    return arbiter->GetTransport()->Begin();
+}
+
+void TwibootArbiterClient::beginTransaction()
+{
+    if (depth == 0)
+    {
+        arbiter->Acquire(priority);
+    }
+    else if (arbiter->Preempted(priority))
+    {
+        // Let whoever is waiting go first, then carry on.
+        arbiter->Release();
+        arbiter->Acquire(priority);
+    }
+}
+
+void TwibootArbiterClient::endTransaction()
+{
+    if (depth == 0)
+        arbiter->Release();
+}
+
+bool TwibootArbiterClient::Write(uint8_t addr, const uint8_t *buf, size_t len)
+{
+    beginTransaction();
+    bool ok = arbiter->GetTransport()->Write(addr, buf, len);
+    endTransaction();
+
+    return ok;
+}
+
+bool TwibootArbiterClient::WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen)
+{
+    beginTransaction();
+    bool ok = arbiter->GetTransport()->WriteRead(addr, wbuf, wlen, rbuf, rlen);
+    endTransaction();
+
+    return ok;
+}
+
+void TwibootArbiterClient::Wait(uint32_t ms)
+{
+    if (depth == 0)
+    {
+        twibootDelay(ms);
+        return;
+    }
+
+    // The device doesn't need the bus while it is busy, so let others have it.
+    arbiter->Release();
+    twibootDelay(ms);
+    arbiter->Acquire(priority);
+}
+
+void TwibootArbiterClient::lock()
+{
+    if (depth++ == 0)
+        arbiter->Acquire(priority);
+}
+
+void TwibootArbiterClient::unlock()
+{
+    if (--depth == 0)
+        arbiter->Release();
+}
@@ -0,0 +1,152 @@
+#ifndef arbiter_h
+#define arbiter_h
+
+#include <mutex>
+#include "transport.h"
+
+#if !defined(PARTICLE)
+#include <condition_variable>
+#endif
+
+/**
+ * The longest a bulk client keeps the bus while others are waiting for it, in milliseconds.
+ */
+#define TWIBOOT_BULK_SLICE_MS 50
+
+/**
+ * The priority classes of the bus arbiter, from most to least urgent.
+ */
+enum TwibootPriority
+{
+    TWIBOOT_PRIORITY_HIGH = 0, // Latency-critical traffic, like sensor reads in a control loop
+    TWIBOOT_PRIORITY_NORMAL,   // Everything else
+    TWIBOOT_PRIORITY_BULK,     // Long transfers, like flashing a device
+    TWIBOOT_PRIORITY_COUNT,
+};
+
+/**
+ * How long requests of one priority class waited for the bus.
+ */
+struct TwibootWaitStats
+{
+    uint32_t count;    // The number of times the bus was acquired
+    uint64_t total_us; // The total time spent waiting, in microseconds
+    uint32_t max_us;   // The longest single wait, in microseconds
+};
+
+/**
+ * Shares one I2C bus between users of different priorities. Whenever the bus is
+ * free, the most urgent waiting user gets it next, and users of the same priority
+ * get it in the order they asked for it. Clients (TwibootArbiterClient)
+ * give the bus up between transactions when someone more urgent is waiting, so a
+ * high-priority request only waits for the transaction in flight (plus the time
+ * to wake its thread), even while a whole image is being flashed. Releasing the
+ * bus wakes the waiters at once, except on Particle, where Device OS does not
+ * reliably provide condition variables and waiters poll every millisecond instead.
+ *
+ * Code that talks to the bus directly (for example through Wire) can take part with
+ * Acquire() and Release() around its transactions.
+ */
+class TwibootArbiter
+{
+public:
+    /**
+     * Construct a new TwibootArbiter object
+     *
+     * @param transport The bus to share.
+     * @param bulkSliceMs The longest a bulk client keeps the bus while others wait, in milliseconds.
+     */
+    TwibootArbiter(TwibootTransport *transport, uint32_t bulkSliceMs = TWIBOOT_BULK_SLICE_MS);
+
+    /**
+     * Waits for the bus and takes it.
+     *
+     * @param priority The priority class of the request.
+     */
+    void Acquire(TwibootPriority priority);
+
+    /**
+     * Gives the bus back.
+     */
+    void Release();
+
+    /**
+     * Gets whether the current holder of the bus should give it up: someone more
+     * urgent is waiting, or a bulk holder has used up its time slice while others wait.
+     *
+     * @param priority The priority class of the holder.
+     */
+    bool Preempted(TwibootPriority priority);
+
+    /**
+     * Gets how long requests of a priority class waited for the bus.
+     *
+     * @param priority The priority class.
+     * @param stats Where to store the statistics.
+     */
+    void GetStats(TwibootPriority priority, TwibootWaitStats *stats);
+
+    /**
+     * Clears the wait statistics of every priority class.
+     */
+    void ResetStats();
+
+    /**
+     * Gets the bus being shared.
+     */
+    inline TwibootTransport *GetTransport() { return transport; };
+
+private:
+    TwibootTransport *transport;                    // The bus being shared
+    uint32_t slice_ms;                              // The time slice of bulk holders
+    std::mutex mutex;                               // Guards everything below
+#if !defined(PARTICLE)
+    std::condition_variable released;               // Signalled whenever the bus is given back
+#endif
+    bool busy;                                      // Whether someone holds the bus
+    uint32_t held_since;                            // When the bus was last acquired
+    uint32_t next_ticket[TWIBOOT_PRIORITY_COUNT];   // The ticket the next waiter in each class gets
+    uint32_t serving[TWIBOOT_PRIORITY_COUNT];       // The ticket served next in each class
+    TwibootWaitStats stats[TWIBOOT_PRIORITY_COUNT]; // The wait statistics of each class
+
+    bool urgentWaiting(TwibootPriority priority); // Whether anyone more urgent than a class is waiting
+    bool anyWaiting();                            // Whether anyone at all is waiting
+};
+
+/**
+ * A transport that goes through a TwibootArbiter with a fixed priority. Every
+ * transaction acquires the bus for itself, unless the client is locked, in which
+ * case it keeps the bus across transactions and only gives it up in between when
+ * preempted. Use one client for each thread.
+ *
+ * End() leaves the shared bus running, since others are still using it.
+ */
+class TwibootArbiterClient : public TwibootTransport
+{
+public:
+    /**
+     * Construct a new TwibootArbiterClient object
+     *
+     * @param arbiter The arbiter of the bus.
+     * @param priority The priority class of this client's transactions.
+     */
+    TwibootArbiterClient(TwibootArbiter *arbiter, TwibootPriority priority);
+
+    bool Begin() override;
+    inline void End() override {};
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override;
+    bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) override;
+    void Wait(uint32_t ms) override;
+    void lock() override;
+    void unlock() override;
+
+private:
+    TwibootArbiter *arbiter;  // The arbiter of the bus
+    TwibootPriority priority; // The priority class of this client's transactions
+    int depth;                // How many times the client is locked
+
+    void beginTransaction(); // Makes sure the client holds the bus for a transaction
+    void endTransaction();   // Gives the bus back after a transaction, unless locked
+};
+
+#endif // arbiter_h
@@ -16,7 +16,7 @@
 #ifndef _crc_h
 #define _crc_h
 
-#include "Particle.h" // Making sure this compiles and links with the Particle SDK
+#include "platform.h" // Making sure this compiles and links with the Particle SDK (or on Linux)
 
 // #define FALSE 0
 // #define TRUE !FALSE
@@ -0,0 +1,142 @@
+#include "emulated_transport.h"
+
+#if !defined(PARTICLE)
+
+#include <string.h>
+
+TwibootEmulatedTransport::TwibootEmulatedTransport(uint8_t address, uint32_t signature, uint8_t pageSize,
+                                                   uint16_t flashSize, uint16_t eepromSize)
+{
+    this->addr = address;
+    this->signature = signature;
+    this->page_size = pageSize;
+    this->flash_size = flashSize;
+    this->eeprom_size = eepromSize;
+    this->flash = new uint8_t[flashSize];
+    this->eeprom = new uint8_t[eepromSize];
+    this->running_app = false;
+    this->page_writes = 0;
+    this->flash_reads = 0;
+
+    memset(flash, 0xFF, flashSize);
+    memset(eeprom, 0xFF, eepromSize);
+}
+
+TwibootEmulatedTransport::~TwibootEmulatedTransport()
+{
+    delete[] flash;
+    delete[] eeprom;
+}
+
+bool TwibootEmulatedTransport::Write(uint8_t addr, const uint8_t *buf, size_t len)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    if (addr != this->addr || running_app || len == 0)
+        return false;
+
+    // 0x00: abort the boot timeout
+    if (len == 1 && buf[0] == 0x00)
+        return true;
+
+    // 0x01 0x80: start the application
+    if (len == 2 && buf[0] == 0x01 && buf[1] == 0x80)
+    {
+        running_app = true;
+        return true;
+    }
+
+    // 0x02 <memtype> <addr high> <addr low> <data...>: write memory
+    if (len > 4 && buf[0] == 0x02)
+    {
+        uint16_t at = buf[2] << 8 | buf[3];
+        size_t n = len - 4;
+
+        if (buf[1] == 0x01)
+        {
+            // Flash is written a page at a time, like the real bootloader does.
+            if (at % page_size != 0 || n > page_size || at + n > flash_size)
+                return false;
+
+            memcpy(&flash[at], &buf[4], n);
+            page_writes++;
+            return true;
+        }
+
+        if (buf[1] == 0x02)
+        {
+            if (at + n > eeprom_size)
+                return false;
+
+            memcpy(&eeprom[at], &buf[4], n);
+            return true;
+        }
+    }
+
+    // 0x02 <memtype> <addr high> <addr low>: only set the address for a read
+    return len == 4 && buf[0] == 0x02;
+}
+
+bool TwibootEmulatedTransport::WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    if (addr != this->addr || running_app || wlen == 0)
+        return false;
+
+    // 0x01: bootloader version
+    if (wlen == 1 && wbuf[0] == 0x01)
+    {
+        char version[16] = "TWIBOOT v3.1";
+        memcpy(rbuf, version, rlen < 16 ? rlen : 16);
+        return rlen <= 16;
+    }
+
+    if (wlen != 4 || wbuf[0] != 0x02)
+        return false;
+
+    uint16_t at = wbuf[2] << 8 | wbuf[3];
+
+    // 0x02 0x00 0x00 0x00: chip info
+    if (wbuf[1] == 0x00)
+    {
+        uint8_t info[8] = {
+            (uint8_t)(signature >> 16),
+            (uint8_t)(signature >> 8),
+            (uint8_t)signature,
+            page_size,
+            (uint8_t)(flash_size >> 8),
+            (uint8_t)flash_size,
+            (uint8_t)(eeprom_size >> 8),
+            (uint8_t)eeprom_size,
+        };
+
+        memcpy(rbuf, info, rlen < 8 ? rlen : 8);
+        return rlen <= 8;
+    }
+
+    // 0x02 0x01 <addr high> <addr low>: read flash
+    if (wbuf[1] == 0x01)
+    {
+        if (at + rlen > flash_size)
+            return false;
+
+        memcpy(rbuf, &flash[at], rlen);
+        flash_reads++;
+        return true;
+    }
+
+    // 0x02 0x02 <addr high> <addr low>: read EEPROM
+    if (wbuf[1] == 0x02)
+    {
+        if (at + rlen > eeprom_size)
+            return false;
+
+        memcpy(rbuf, &eeprom[at], rlen);
+        return true;
+    }
+
+    return false;
+}
+
+#endif // !PARTICLE
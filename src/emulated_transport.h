@@ -0,0 +1,81 @@
+#ifndef emulated_transport_h
+#define emulated_transport_h
+
+#if !defined(PARTICLE)
+
+#include <mutex>
+#include "transport.h"
+
+/**
+ * A transport with an emulated twiboot device on the other end, for testing on a
+ * host without any hardware. It answers the same commands as the real bootloader:
+ * abort boot timeout, version, chip info, flash and EEPROM reads and writes, and exit.
+ * Once the device has been told to start its application, it stops answering until
+ * Reset() is called.
+ */
+class TwibootEmulatedTransport : public TwibootTransport
+{
+public:
+    /**
+     * Construct a new TwibootEmulatedTransport object. Flash and EEPROM start out erased.
+     *
+     * @param address The address the emulated device answers on.
+     * @param signature The signature of the emulated chip.
+     * @param pageSize The size of a flash page, in bytes.
+     * @param flashSize The size of the application section of flash, in bytes.
+     * @param eepromSize The size of the EEPROM, in bytes.
+     */
+    TwibootEmulatedTransport(uint8_t address = 0x29, uint32_t signature = 0x1E950F, uint8_t pageSize = 128,
+                             uint16_t flashSize = 0x7C00, uint16_t eepromSize = 1024);
+
+    ~TwibootEmulatedTransport();
+
+    inline bool Begin() override { return true; };
+    inline void End() override {};
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override;
+    bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) override;
+    inline void lock() override { mutex.lock(); };
+    inline void unlock() override { mutex.unlock(); };
+
+    /**
+     * Resets the emulated device back into the bootloader.
+     */
+    inline void Reset() { running_app = false; };
+
+    /**
+     * Gets whether the emulated device was told to start its application.
+     */
+    inline bool IsRunningApp() { return running_app; };
+
+    /**
+     * Gets the emulated flash, so tests can inspect or change it behind the library's back.
+     */
+    inline uint8_t *GetFlash() { return flash; };
+
+    /**
+     * Gets the number of flash pages written so far.
+     */
+    inline uint32_t GetPageWrites() { return page_writes; };
+
+    /**
+     * Gets the number of flash reads so far.
+     */
+    inline uint32_t GetFlashReads() { return flash_reads; };
+
+private:
+    uint8_t addr;                // The address the emulated device answers on
+    uint32_t signature;          // The signature of the emulated chip
+    uint8_t page_size;           // The size of a flash page
+    uint16_t flash_size;         // The size of the application section
+    uint16_t eeprom_size;        // The size of the EEPROM
+    uint8_t *flash;              // The emulated flash
+    uint8_t *eeprom;             // The emulated EEPROM
+    bool running_app;            // Whether the device left the bootloader
+    uint32_t page_writes;        // The number of flash pages written
+    uint32_t flash_reads;        // The number of flash reads
+    std::recursive_mutex mutex;  // Held by whoever is using the bus
+};
+
+#endif // !PARTICLE
+
+#endif // emulated_transport_h
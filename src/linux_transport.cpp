@@ -0,0 +1,70 @@
+#include "linux_transport.h"
+
+#if defined(__linux__) && !defined(PARTICLE)
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+TwibootLinuxTransport::TwibootLinuxTransport(const char *device)
+{
+    this->device = strdup(device);
+    this->fd = -1;
+}
+
+TwibootLinuxTransport::~TwibootLinuxTransport()
+{
+    End();
+    free(device);
+}
+
+bool TwibootLinuxTransport::Begin()
+{
+    if (fd < 0 && device != nullptr)
+        fd = open(device, O_RDWR);
+
+    return fd >= 0;
+}
+
+void TwibootLinuxTransport::End()
+{
+    if (fd >= 0)
+        close(fd);
+
+    fd = -1;
+}
+
+bool TwibootLinuxTransport::Write(uint8_t addr, const uint8_t *buf, size_t len)
+{
+    struct i2c_msg msg = {addr, 0, (uint16_t)len, (uint8_t *)buf};
+
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return transfer(&msg, 1) == 1;
+}
+
+bool TwibootLinuxTransport::WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen)
+{
+    struct i2c_msg msgs[2] = {
+        {addr, 0, (uint16_t)wlen, (uint8_t *)wbuf},
+        {addr, I2C_M_RD, (uint16_t)rlen, rbuf},
+    };
+
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return transfer(msgs, 2) == 2;
+}
+
+int TwibootLinuxTransport::transfer(struct i2c_msg *msgs, int count)
+{
+    struct i2c_rdwr_ioctl_data data = {msgs, (uint32_t)count};
+
+    if (!Begin())
+        return -1;
+
+    return ioctl(fd, I2C_RDWR, &data);
+}
+
+#endif // __linux__
@@ -0,0 +1,56 @@
+#ifndef linux_transport_h
+#define linux_transport_h
+
+#if defined(__linux__) && !defined(PARTICLE)
+
+#include <mutex>
+#include "transport.h"
+
+struct i2c_msg;
+
+/**
+ * A transport over a Linux i2c-dev bus (/dev/i2c-N). Every transaction is a single
+ * I2C_RDWR ioctl, so a write followed by a read goes out as one combined transaction
+ * with a repeated START, in one system call. The bus adapter must support plain I2C
+ * transfers (I2C_FUNC_I2C); SMBus-only adapters such as i2c-stub do not.
+ */
+class TwibootLinuxTransport : public TwibootTransport
+{
+public:
+    /**
+     * Construct a new TwibootLinuxTransport object
+     *
+     * @param device The path of the bus, like "/dev/i2c-1". It is copied.
+     */
+    TwibootLinuxTransport(const char *device);
+
+    ~TwibootLinuxTransport();
+
+    bool Begin() override;
+    void End() override;
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override;
+    bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) override;
+    inline void lock() override { mutex.lock(); };
+    inline void unlock() override { mutex.unlock(); };
+
+protected:
+    /**
+     * Sends messages as one combined transaction, opening the bus if needed.
+     * Tests override this to talk to an emulated device instead of the kernel.
+     *
+     * @param msgs The messages to send.
+     * @param count The number of messages.
+     *
+     * @returns The number of messages transferred, or -1 on error.
+     */
+    virtual int transfer(struct i2c_msg *msgs, int count);
+
+private:
+    char *device;                // The path of the bus
+    int fd;                      // The open bus, or -1
+    std::recursive_mutex mutex;  // Held by whoever is using the bus
+};
+
+#endif // __linux__
+
+#endif // linux_transport_h
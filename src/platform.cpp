@@ -0,0 +1,85 @@
+#include "platform.h"
+
+#if !defined(PARTICLE)
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void twibootDelay(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+uint32_t twibootMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+uint32_t twibootMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)(now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+bool twibootSetReset(pin_t pin, bool asserted)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/direction", pin);
+
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return false;
+
+    // "low" makes the pin an output driven low in one step; "in" lets it float back up.
+    const char *direction = asserted ? "low" : "in";
+    bool ok = write(fd, direction, strlen(direction)) == (ssize_t)strlen(direction);
+    close(fd);
+
+    return ok;
+}
+
+static int openStorage()
+{
+    const char *path = getenv("TWIBOOT_STORAGE");
+    return open(path != nullptr ? path : TWIBOOT_STORAGE_FILE, O_RDWR | O_CREAT, 0644);
+}
+
+size_t twibootStorageLength()
+{
+    return TWIBOOT_STORAGE_SIZE;
+}
+
+void twibootStorageRead(int offset, void *buf, size_t len)
+{
+    // Like erased EEPROM, anything never written reads as 0xFF.
+    memset(buf, 0xFF, len);
+
+    int fd = openStorage();
+    if (fd < 0)
+        return;
+
+    if (pread(fd, buf, len, offset) < 0)
+        memset(buf, 0xFF, len);
+
+    close(fd);
+}
+
+bool twibootStorageWrite(int offset, const void *buf, size_t len)
+{
+    int fd = openStorage();
+    if (fd < 0)
+        return false;
+
+    bool ok = pwrite(fd, buf, len, offset) == (ssize_t)len;
+    close(fd);
+
+    return ok;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef platform_h
+#define platform_h
+
+/*
+ * The few things the library needs from the system it runs on, other than the I2C
+ * bus itself: time, the GPIO wired to the device's RESET line, and persistent
+ * storage for the manifest. On Particle these are thin wrappers around the Device
+ * OS API. On Linux they are implemented in platform.cpp.
+ */
+
+#if defined(PARTICLE)
+
+#include "Particle.h"
+
+inline void twibootDelay(uint32_t ms) { delay(ms); }
+
+inline uint32_t twibootMillis() { return millis(); }
+
+inline uint32_t twibootMicros() { return micros(); }
+
+/**
+ * Drives the RESET line. It is only ever pulled low; when released, the device's
+ * own pull-up brings it back up.
+ */
+inline bool twibootSetReset(pin_t pin, bool asserted)
+{
+    if (asserted)
+    {
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
+    else
+    {
+        pinMode(pin, INPUT);
+    }
+
+    return true;
+}
+
+inline size_t twibootStorageLength() { return EEPROM.length(); }
+
+inline void twibootStorageRead(int offset, void *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        ((uint8_t *)buf)[i] = EEPROM.read(offset + i);
+    }
+}
+
+inline bool twibootStorageWrite(int offset, const void *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        EEPROM.write(offset + i, ((const uint8_t *)buf)[i]);
+    }
+
+    return true;
+}
+
+#else
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/**
+ * On Linux, a pin is the number of a GPIO exported through /sys/class/gpio.
+ */
+typedef uint16_t pin_t;
+
+#define PIN_INVALID ((pin_t)0xFFFF)
+
+/**
+ * The size of the storage file that stands in for EEPROM on Linux.
+ */
+#define TWIBOOT_STORAGE_SIZE 4096
+
+/**
+ * The storage file that stands in for EEPROM on Linux, unless the TWIBOOT_STORAGE
+ * environment variable names another one.
+ */
+#define TWIBOOT_STORAGE_FILE "twiboot.eeprom"
+
+void twibootDelay(uint32_t ms);
+uint32_t twibootMillis();
+uint32_t twibootMicros();
+bool twibootSetReset(pin_t pin, bool asserted);
+size_t twibootStorageLength();
+void twibootStorageRead(int offset, void *buf, size_t len);
+bool twibootStorageWrite(int offset, const void *buf, size_t len);
+
+#endif
+
+#endif // platform_h
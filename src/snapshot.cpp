@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+
+TwibootSnapshot::TwibootSnapshot()
+{
+    num_pages = 0;
+    page_size = 0;
+    signature = 0;
+    addr = 0;
+    hashes = nullptr;
+    slots = nullptr;
+    data = nullptr;
+    num_stored = 0;
+    capacity = 0;
+}
+
+TwibootSnapshot::~TwibootSnapshot()
+{
+    Clear();
+}
+
+bool TwibootSnapshot::Init(uint16_t numPages, uint8_t pageSize, uint32_t signature, uint8_t addr)
+{
+    Clear();
+
+    hashes = (uint32_t *)malloc(numPages * sizeof(uint32_t));
+    slots = (uint16_t *)malloc(numPages * sizeof(uint16_t));
+    if (hashes == nullptr || slots == nullptr)
+    {
+        Clear();
+        return false;
+    }
+
+    for (int i = 0; i < numPages; i++)
+    {
+        hashes[i] = 0;
+        slots[i] = TWIBOOT_SNAPSHOT_EMPTY;
+    }
+
+    num_pages = numPages;
+    page_size = pageSize;
+    this->signature = signature;
+    this->addr = addr;
+
+    return true;
+}
+
+void TwibootSnapshot::Clear()
+{
+    free(hashes);
+    free(slots);
+    free(data);
+
+    num_pages = 0;
+    hashes = nullptr;
+    slots = nullptr;
+    data = nullptr;
+    num_stored = 0;
+    capacity = 0;
+}
+
+bool TwibootSnapshot::SetPage(uint16_t page, uint8_t *buf, uint32_t hash)
+{
+    bool empty = true;
+    for (int i = 0; i < page_size; i++)
+    {
+        if (buf[i] != 0xFF)
+        {
+            empty = false;
+            break;
+        }
+    }
+
+    hashes[page] = hash;
+
+    if (empty)
+    {
+        slots[page] = TWIBOOT_SNAPSHOT_EMPTY; // any space it had is simply left unused
+        return true;
+    }
+
+    if (slots[page] == TWIBOOT_SNAPSHOT_EMPTY)
+    {
+        // Grow the data a few pages at a time, since most of the flash is often empty.
+        if (num_stored == capacity)
+        {
+            uint16_t grown = capacity + 16;
+            uint8_t *tmp = (uint8_t *)realloc(data, (size_t)grown * page_size);
+            if (tmp == nullptr)
+                return false;
+
+            data = tmp;
+            capacity = grown;
+        }
+
+        slots[page] = num_stored++;
+    }
+
+    memcpy(&data[(size_t)slots[page] * page_size], buf, page_size);
+
+    return true;
+}
+
+void TwibootSnapshot::GetPage(uint16_t page, uint8_t *buf)
+{
+    if (slots[page] == TWIBOOT_SNAPSHOT_EMPTY)
+    {
+        memset(buf, 0xFF, page_size);
+    }
+    else
+    {
+        memcpy(buf, &data[(size_t)slots[page] * page_size], page_size);
+    }
+}
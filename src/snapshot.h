@@ -0,0 +1,115 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * Marks a page that is not stored in a snapshot because it is erased (all 0xFF).
+ */
+#define TWIBOOT_SNAPSHOT_EMPTY 0xFFFF
+
+/**
+ * A copy of a device's flash, taken with Twiboot::Snapshot() and restored with
+ * Twiboot::Rollback(). Only pages that hold data are stored; erased pages are only
+ * marked as empty. Every page also keeps a hash, so it can be compared with the
+ * device without comparing the data itself.
+ */
+class TwibootSnapshot
+{
+public:
+    /**
+     * Construct a new, empty TwibootSnapshot object
+     */
+    TwibootSnapshot();
+
+    ~TwibootSnapshot();
+
+    /**
+     * Clears the snapshot and makes room for a new one.
+     *
+     * @param numPages The number of pages in the snapshot.
+     * @param pageSize The size of a page, in bytes.
+     * @param signature The signature of the chip the snapshot is taken from.
+     * @param addr The address of the device the snapshot is taken from.
+     *
+     * @returns True if there was enough memory. Otherwise, false.
+     */
+    bool Init(uint16_t numPages, uint8_t pageSize, uint32_t signature, uint8_t addr);
+
+    /**
+     * Frees the memory used by the snapshot.
+     */
+    void Clear();
+
+    /**
+     * Stores a page in the snapshot. Erased pages are only marked as empty.
+     *
+     * @param page The page to store (zero-indexed).
+     * @param data The contents of the page.
+     * @param hash The hash of the page.
+     *
+     * @returns True if there was enough memory. Otherwise, false.
+     */
+    bool SetPage(uint16_t page, uint8_t *data, uint32_t hash);
+
+    /**
+     * Gets a page from the snapshot.
+     *
+     * @param page The page to get (zero-indexed).
+     * @param buf The buffer to store the page in (at least the page size).
+     */
+    void GetPage(uint16_t page, uint8_t *buf);
+
+    /**
+     * Gets the hash of a page in the snapshot.
+     *
+     * @param page The page (zero-indexed).
+     */
+    inline uint32_t GetHash(uint16_t page) { return hashes[page]; };
+
+    /**
+     * Gets whether a page in the snapshot is erased (all 0xFF).
+     *
+     * @param page The page (zero-indexed).
+     */
+    inline bool IsEmpty(uint16_t page) { return slots[page] == TWIBOOT_SNAPSHOT_EMPTY; };
+
+    /**
+     * Gets the number of pages in the snapshot.
+     */
+    inline uint16_t GetNumPages() { return num_pages; };
+
+    /**
+     * Gets the size of a page in the snapshot, in bytes.
+     */
+    inline uint8_t GetPageSize() { return page_size; };
+
+    /**
+     * Gets the signature of the chip the snapshot was taken from.
+     */
+    inline uint32_t GetSignature() { return signature; };
+
+    /**
+     * Gets the address of the device the snapshot was taken from.
+     */
+    inline uint8_t GetAddress() { return addr; };
+
+    /**
+     * Gets how much memory the page data of the snapshot takes, in bytes.
+     */
+    inline size_t GetDataSize() { return (size_t)num_stored * page_size; };
+
+private:
+    uint16_t num_pages;  // The number of pages in the snapshot
+    uint8_t page_size;   // The size of a page, in bytes
+    uint32_t signature;  // The signature of the chip the snapshot was taken from
+    uint8_t addr;        // The address of the device the snapshot was taken from
+    uint32_t *hashes;    // The hash of each page
+    uint16_t *slots;     // Where each page is stored in data, or TWIBOOT_SNAPSHOT_EMPTY
+    uint8_t *data;       // The pages that are not empty, packed one after another
+    uint16_t num_stored; // The number of pages stored in data
+    uint16_t capacity;   // The number of pages data has room for
+};
+
+#endif // snapshot_h
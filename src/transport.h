@@ -0,0 +1,105 @@
+#ifndef transport_h
+#define transport_h
+
+#include <mutex>
+#include "platform.h"
+
+/**
+ * Helper macro to hold a transport's lock for the block that follows, like WITH_LOCK.
+ */
+#define WITH_TRANSPORT_LOCK(transport) \
+    for (bool __todo = true; __todo;)  \
+        for (std::lock_guard<TwibootTransport> __lock(*(transport)); __todo; __todo = false)
+
+/**
+ * Helper macro to let go of a transport's lock for the block that follows, taking it
+ * back afterwards. Used inside WITH_TRANSPORT_LOCK around slow work that doesn't need
+ * the bus, like writing to EEPROM.
+ */
+#define WITHOUT_TRANSPORT_LOCK(transport)                   \
+    for (bool __todo_unlocked = true; __todo_unlocked;) \
+        for (TwibootTransportUnlock __unlock(*(transport)); __todo_unlocked; __todo_unlocked = false)
+
+/**
+ * The I2C bus Twiboot talks to the device over. Every bus transaction goes through
+ * one of these, so the same flashing code runs on any system with a backend for it.
+ *
+ * The lock is recursive and may be held across several transactions that must not be
+ * interleaved with other users of the bus. It follows the standard lock()/unlock()
+ * naming so that it works with std::lock_guard.
+ */
+class TwibootTransport
+{
+public:
+    virtual ~TwibootTransport() {}
+
+    /**
+     * Starts the bus, if it is not started yet.
+     *
+     * @returns True if the bus is ready. Otherwise, false.
+     */
+    virtual bool Begin() = 0;
+
+    /**
+     * Lets go of the bus.
+     */
+    virtual void End() = 0;
+
+    /**
+     * Writes bytes to a device, as one transaction ending with a STOP.
+     *
+     * @param addr The address of the device.
+     * @param buf The bytes to write.
+     * @param len The number of bytes to write.
+     *
+     * @returns True if the device acknowledged every byte. Otherwise, false.
+     */
+    virtual bool Write(uint8_t addr, const uint8_t *buf, size_t len) = 0;
+
+    /**
+     * Writes bytes to a device, then reads its reply after a repeated START, as one
+     * transaction.
+     *
+     * @param addr The address of the device.
+     * @param wbuf The bytes to write.
+     * @param wlen The number of bytes to write.
+     * @param rbuf The buffer to store the reply in.
+     * @param rlen The number of bytes to read.
+     *
+     * @returns True if the write was acknowledged and the whole reply was read. Otherwise, false.
+     */
+    virtual bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) = 0;
+
+    /**
+     * Waits while the device is busy (for example, programming a page) and does not
+     * need the bus. Backends that share the bus may let others use it meanwhile.
+     *
+     * @param ms How long to wait, in milliseconds.
+     */
+    virtual void Wait(uint32_t ms) { twibootDelay(ms); };
+
+    /**
+     * Takes the bus for the calling thread.
+     */
+    virtual void lock() = 0;
+
+    /**
+     * Gives the bus back.
+     */
+    virtual void unlock() = 0;
+};
+
+/**
+ * Releases a transport's lock for as long as it exists. See WITHOUT_TRANSPORT_LOCK.
+ */
+class TwibootTransportUnlock
+{
+public:
+    TwibootTransportUnlock(TwibootTransport &transport) : transport(transport) { transport.unlock(); }
+    ~TwibootTransportUnlock() { transport.lock(); }
+
+private:
+    TwibootTransport &transport; // The transport to take back on destruction
+};
+
+#endif // transport_h
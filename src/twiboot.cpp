@@ -1,84 +1,175 @@
-#include "Particle.h"
 #include "twiboot.h"
 #include "crc.h"
 
-Twiboot::Twiboot()
+/**
+ * Hashes a page of flash for the manifest (32-bit FNV-1a).
+ */
+static uint32_t pageHash(const uint8_t *buf, int len)
 {
-    START_WIRE;
-    this->addr = 0x29;
+    uint32_t hash = 0x811C9DC5;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash ^= buf[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
 }
 
-Twiboot::Twiboot(uint8_t address)
+/**
+ * Copies a page out of a buffer, padding whatever is past the end of the buffer with 0xFF.
+ */
+static void padPage(uint8_t *data, const uint8_t *buf, int len, int index, int pageSize)
 {
-    START_WIRE;
+    for (int j = 0; j < pageSize; j++)
+    {
+        if (index * pageSize + j < len)
+        {
+            data[j] = buf[index * pageSize + j];
+        }
+        else
+        {
+            data[j] = 0xFF;
+        }
+    }
+}
+
+#if defined(PARTICLE)
+/**
+ * The transport used when none is given, created on first use.
+ */
+static TwibootTransport *wireTransport()
+{
+    static TwibootWireTransport transport;
+    return &transport;
+}
+
+Twiboot::Twiboot() : Twiboot(wireTransport(), 0x29, PIN_INVALID)
+{
+}
+
+Twiboot::Twiboot(uint8_t address) : Twiboot(wireTransport(), address, PIN_INVALID)
+{
+}
+
+Twiboot::Twiboot(uint8_t address, pin_t resetPin) : Twiboot(wireTransport(), address, resetPin)
+{
+}
+#endif
+
+Twiboot::Twiboot(TwibootTransport *transport, uint8_t address, pin_t resetPin)
+{
+    this->transport = transport;
+    this->transport->Begin();
     this->addr = address;
+    this->page_size = 0; // not known until the device is asked for it
+    this->reset_pin = resetPin;
+    this->entry_delay = 0;
+    this->entry_latency = 0;
+    this->manifest_offset = -1;
 }
 
 bool Twiboot::Init()
 {
-    START_WIRE;
+    if (!transport->Begin())
+        return false;
 
     uint8_t *pgsz = &this->page_size;
 
-    WITH_LOCK(Wire)
-    {
-        Wire.beginTransmission(addr);
-        Wire.write(0x00);
-        if (Wire.endTransmission() != 0) // if there are any errors, return false. Otherwise, return true.
-            return false;
-    }
+    if (!abortBootTimeout())
+        return false;
 
     return GetChipInfo(nullptr, pgsz, nullptr, nullptr);
 }
 
-bool Twiboot::GetBootloaderVersion(char *buf)
+bool Twiboot::abortBootTimeout()
 {
-    int i = 0;
+    uint8_t cmd = 0x00;
+    return transport->Write(addr, &cmd, 1);
+}
 
-    WITH_LOCK(Wire)
-    {
-        Wire.beginTransmission(addr);
-        Wire.write(0x01);
+bool Twiboot::resetDevice()
+{
+    // Only ever pull RESET low, and let the device's pull-up bring it back up.
+    if (!twibootSetReset(reset_pin, true))
+        return false;
+
+    twibootDelay(TWIBOOT_RESET_PULSE_MS);
 
-        if (Wire.endTransmission() != 0) // if there are any errors, return false. Otherwise, return true.
+    return twibootSetReset(reset_pin, false);
+}
+
+bool Twiboot::EnterBootloader(uint8_t attempts)
+{
+    if (!transport->Begin())
+        return false;
+
+    if (reset_pin == PIN_INVALID)
+        return Init();
+
+    uint32_t start = twibootMillis();
+
+    for (uint8_t attempt = 0; attempt < attempts; attempt++)
+    {
+        if (!resetDevice())
             return false;
 
-        Wire.requestFrom(addr, 16);
-        while (Wire.available())
+        uint32_t reset = twibootMillis();
+        twibootDelay(entry_delay); // skip the part of the window where the device is still starting up
+
+        while (twibootMillis() - reset < TWIBOOT_ENTRY_WINDOW_MS)
         {
-            buf[i] = Wire.read();
-            i++;
+            if (!abortBootTimeout())
+            {
+                twibootDelay(1);
+                continue;
+            }
+
+            uint32_t elapsed = twibootMillis() - reset;
+            char version[16];
+
+            // Something answered, but make sure it is the bootloader and not an application
+            // that happens to use the same address.
+            if (!GetBootloaderVersion(version) || strncmp(version, "TWIBOOT", 7) != 0)
+                break;
+
+            entry_delay = elapsed > TWIBOOT_ENTRY_MARGIN_MS ? elapsed - TWIBOOT_ENTRY_MARGIN_MS : 0;
+            entry_latency = twibootMillis() - start;
+
+            return GetChipInfo(nullptr, &this->page_size, nullptr, nullptr);
         }
+
+        // Missed the bootloader, so start earlier on the next attempt.
+        entry_delay /= 2;
     }
 
-    return i == 16;
+    return false;
 }
 
-bool Twiboot::GetChipInfo(uint64_t *signature, uint8_t *pageSize, uint16_t *flashSize, uint16_t *eepromSize)
+bool Twiboot::GetBootloaderVersion(char *buf)
 {
-    WITH_LOCK(Wire)
-    {
-        Wire.beginTransmission(addr);
-        Wire.write(0x02);
-        Wire.write(0x00);
-        Wire.write(0x00);
-        Wire.write(0x00);
-
-        if (Wire.endTransmission() != 0) // if there are any errors, return false. Otherwise, return true.
-            return false;
+    uint8_t cmd = 0x01;
+    return transport->WriteRead(addr, &cmd, 1, (uint8_t *)buf, 16);
+}
 
-        Wire.requestFrom(addr, 8);
-        while (!Wire.available())
-            ;
-        *signature = Wire.read() << 16;
-        *signature |= Wire.read() << 8;
-        *signature |= Wire.read();
-        *pageSize = Wire.read();
-        *flashSize = Wire.read() << 8;
-        *flashSize |= Wire.read();
-        *eepromSize = Wire.read() << 8;
-        *eepromSize |= Wire.read();
-    }
+bool Twiboot::GetChipInfo(uint64_t *signature, uint8_t *pageSize, uint16_t *flashSize, uint16_t *eepromSize)
+{
+    uint8_t cmd[4] = {0x02, 0x00, 0x00, 0x00};
+    uint8_t info[8];
+
+    if (!transport->WriteRead(addr, cmd, 4, info, 8)) // if there are any errors, return false. Otherwise, return true.
+        return false;
+
+    // Any of the outputs may be left out by passing nullptr.
+    if (signature != nullptr)
+        *signature = (uint64_t)info[0] << 16 | info[1] << 8 | info[2];
+    if (pageSize != nullptr)
+        *pageSize = info[3];
+    if (flashSize != nullptr)
+        *flashSize = info[4] << 8 | info[5];
+    if (eepromSize != nullptr)
+        *eepromSize = info[6] << 8 | info[7];
 
     return true;
 }
@@ -136,75 +227,144 @@ bool Twiboot::GetChipInfo(uint64_t *signature, uint8_t *pageSize, uint16_t *flas
 
 bool Twiboot::ReadFlashPage(uint8_t *buf, uint16_t page)
 {
-    WITH_LOCK(Wire)
-    {
-        byte tmp[4] = {
-            0x02,
-            0x01,
-            (uint8_t)((page * page_size) >> 8 & 0xFF),
-            (uint8_t)((page * page_size) & 0xFF),
-        };
+    uint8_t tmp[4] = {
+        0x02,
+        0x01,
+        (uint8_t)((page * page_size) >> 8 & 0xFF),
+        (uint8_t)((page * page_size) & 0xFF),
+    };
+
+    return transport->WriteRead(addr, tmp, 4, buf, page_size);
+}
+
+bool Twiboot::writePage(uint8_t *data, uint16_t page)
+{
+    uint8_t tmp[page_size + 4] = {
+        0x02,
+        0x01,
+        (uint8_t)(((page * page_size) >> 8) & 0xFF),
+        (uint8_t)((page * page_size) & 0xFF),
+    };
 
-        Wire.beginTransmission(addr);
-        Wire.write(tmp, 4);
+    memcpy(&tmp[4], data, page_size);
 
-        if (Wire.endTransmission() != 0) // if there are any errors, return false. Otherwise, return true.
-            return false;
+    if (!transport->Write(addr, tmp, page_size + 4))
+        return false;
+
+    transport->Wait(20); // wait for the flash to finish
+
+    return true;
+}
 
-        Wire.requestFrom(this->addr, page_size);
+bool Twiboot::WriteFlash(uint8_t *buf, int len, uint16_t page)
+{
+    int numPages = NUM_PAGES_IN(len);
 
-        for (int i = 0; i < page_size; i++)
+    ClearManifest(); // the device won't match the manifest anymore
+
+    WITH_TRANSPORT_LOCK(transport)
+    {
+
+        for (int i = 0; i < numPages; i++)
         {
-            buf[i] = Wire.read();
+            uint8_t data[page_size];
+
+            padPage(data, buf, len, i, page_size);
+
+            if (!writePage(data, i + page))
+                return false;
         }
     }
 
     return true;
 }
 
-bool Twiboot::WriteFlash(uint8_t *buf, int len, uint16_t page)
+bool Twiboot::WriteFlashDelta(uint8_t *buf, int len, uint16_t page, int *pagesWritten)
 {
+    int written = 0;
+
+    uint64_t signature;
+    if (!GetChipInfo(&signature, &this->page_size, nullptr, nullptr))
+        return false;
+
     int numPages = NUM_PAGES_IN(len);
 
-    WITH_LOCK(Wire)
-    {
+    TwibootManifest manifest;
+    bool haveManifest = loadManifest(&manifest, signature);
+
+    // If the manifest already covers the whole image (say, after a Snapshot()), keep it
+    // and update the pages that change, so it goes on describing the rest of the flash.
+    bool keepManifest = haveManifest && page >= manifest.first_page &&
+                        page + numPages <= manifest.first_page + manifest.num_pages;
 
+    WITH_TRANSPORT_LOCK(transport)
+    {
         for (int i = 0; i < numPages; i++)
         {
-            byte tmp[page_size + 4] = {
-                0x02,
-                0x01,
-                (uint8_t)((((i + page) * page_size) >> 8) & 0xFF),
-                (uint8_t)(((i + page) * page_size) & 0xFF),
-            };
+            uint16_t target = i + page;
+            uint8_t data[page_size];
+            uint8_t read[page_size];
 
-            for (int j = 0; j < page_size; j++)
+            padPage(data, buf, len, i, page_size);
+
+            bool same;
+            if (haveManifest && target >= manifest.first_page && target < manifest.first_page + manifest.num_pages)
+            {
+                same = manifestHash(&manifest, target) == pageHash(data, page_size);
+            }
+            else
+            {
+                if (!ReadFlashPage(read, target))
+                    return false;
+
+                same = memcmp(read, data, page_size) == 0;
+            }
+
+            if (same)
+                continue;
+
+            // The device no longer matches the manifest, so don't trust it if this fails halfway.
+            if (written == 0 && !keepManifest)
             {
-                if (i * page_size + j < len)
+                WITHOUT_TRANSPORT_LOCK(transport)
                 {
-                    tmp[j + 4] = buf[i * page_size + j];
+                    ClearManifest();
                 }
-                else
+            }
+
+            if (!writePage(data, target) || !ReadFlashPage(read, target) || memcmp(read, data, page_size) != 0)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
                 {
-                    tmp[j + 4] = 0xFF;
+                    ClearManifest(); // what the page holds now is unknown
                 }
+                return false;
             }
 
-            Wire.beginTransmission(addr);
-            Wire.write(tmp, page_size + 4);
-            if (Wire.endTransmission() != 0)
-                return false;
+            if (keepManifest)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    updateManifest(&manifest, target, data);
+                }
+            }
 
-            delay(20); // wait for the flash to finish
+            written++;
         }
     }
 
+    if (pagesWritten != nullptr)
+        *pagesWritten = written;
+
+    if (!keepManifest)
+        saveManifest(signature, buf, len, page);
+
     return true;
 }
 
 bool Twiboot::Verify(uint8_t *buf, int len, uint16_t page)
 {
-    WITH_LOCK(Wire)
+    WITH_TRANSPORT_LOCK(transport)
     {
         for (int i = 0; i < NUM_PAGES_IN(len); i++)
         {
@@ -236,17 +396,363 @@ bool Twiboot::Verify(uint8_t *buf, int len, uint16_t page)
     return true;
 }
 
-bool Twiboot::Exit()
+bool Twiboot::PatchFlash(TwibootPatch *patches, int count, int *pagesWritten)
 {
-    WITH_LOCK(Wire)
+    int written = 0;
+
+    if (pagesWritten != nullptr)
+        *pagesWritten = 0;
+
+    uint64_t signature;
+    uint16_t flashSize;
+    if (!GetChipInfo(&signature, &this->page_size, &flashSize, nullptr))
+        return false;
+
+    // Refuse the whole batch up front, rather than failing after some pages are written.
+    for (int i = 0; i < count; i++)
     {
-        Wire.beginTransmission(addr);
-        Wire.write(0x01);
-        Wire.write(0x80);
-        if (Wire.endTransmission() != 0)
+        if ((uint32_t)patches[i].addr + patches[i].len > flashSize)
             return false;
-        Wire.end();
+    }
+
+    // Every page that is patched is read anyway, so check those against the manifest
+    // instead of spot-checking other pages.
+    TwibootManifest manifest;
+    bool haveManifest = loadManifest(&manifest, signature, false);
+
+    // Only the pages between the first and last patched byte can change.
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (patches[i].len == 0)
+            continue;
+
+        uint32_t from = patches[i].addr / page_size;
+        uint32_t to = ((uint32_t)patches[i].addr + patches[i].len - 1) / page_size;
+
+        first = from < first ? from : first;
+        last = to > last ? to : last;
+    }
+
+    WITH_TRANSPORT_LOCK(transport)
+    {
+        for (uint32_t page = first; page <= last; page++)
+        {
+            uint32_t start = page * page_size;
+            uint32_t end = start + page_size;
+            uint8_t data[page_size];
+            uint8_t read[page_size];
+            bool touched = false;
+
+            for (int i = 0; i < count; i++)
+            {
+                if (patches[i].len > 0 && patches[i].addr < end && patches[i].addr + patches[i].len > start)
+                    touched = true;
+            }
+
+            if (!touched)
+                continue;
+
+            if (!ReadFlashPage(read, page))
+                return false;
+
+            bool inManifest = haveManifest && page >= manifest.first_page && page < (uint32_t)manifest.first_page + manifest.num_pages;
+
+            if (inManifest && pageHash(read, page_size) != manifestHash(&manifest, page))
+            {
+                // Something else flashed the device since the manifest was written.
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    ClearManifest();
+                }
+                haveManifest = false;
+                inManifest = false;
+            }
+
+            memcpy(data, read, page_size);
+
+            for (int i = 0; i < count; i++)
+            {
+                uint32_t from = patches[i].addr > start ? patches[i].addr : start;
+                uint32_t to = patches[i].addr + patches[i].len < end ? patches[i].addr + patches[i].len : end;
+
+                for (uint32_t j = from; j < to; j++)
+                {
+                    data[j - start] = patches[i].buf[j - patches[i].addr];
+                }
+            }
+
+            if (memcmp(data, read, page_size) == 0)
+                continue;
+
+            if (!writePage(data, page) || !ReadFlashPage(read, page) || memcmp(read, data, page_size) != 0)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    ClearManifest(); // what the page holds now is unknown
+                }
+                return false;
+            }
+
+            if (inManifest)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    updateManifest(&manifest, page, data);
+                }
+            }
+
+            written++;
+
+            if (pagesWritten != nullptr)
+                *pagesWritten = written;
+        }
+    }
+
+    return true;
+}
+
+bool Twiboot::Snapshot(TwibootSnapshot *snapshot)
+{
+    uint64_t signature;
+    uint16_t flashSize;
+    if (!GetChipInfo(&signature, &this->page_size, &flashSize, nullptr))
+        return false;
+
+    int numPages = flashSize / page_size;
+    if (!snapshot->Init(numPages, page_size, signature, addr))
+        return false;
+
+    WITH_TRANSPORT_LOCK(transport)
+    {
+        for (int i = 0; i < numPages; i++)
+        {
+            uint8_t read[page_size];
+
+            if (!ReadFlashPage(read, i) || !snapshot->SetPage(i, read, pageHash(read, page_size)))
+                return false;
+        }
+    }
+
+    // The whole flash is known now, so let the manifest describe all of it.
+    if (manifestFits(numPages))
+    {
+        ClearManifest();
+
+        for (int i = 0; i < numPages; i++)
+        {
+            if (!writeManifestHash(i, snapshot->GetHash(i)))
+                return true; // the snapshot is still good, only the manifest is left invalid
+        }
+
+        commitManifest(signature, 0, numPages);
     }
 
     return true;
 }
+
+bool Twiboot::Rollback(TwibootSnapshot *snapshot, int *pagesWritten)
+{
+    int written = 0;
+
+    uint64_t signature;
+    uint16_t flashSize;
+    if (!GetChipInfo(&signature, &this->page_size, &flashSize, nullptr))
+        return false;
+
+    // Refuse a snapshot of another device before writing anything.
+    if (snapshot->GetSignature() != signature ||
+        snapshot->GetAddress() != addr ||
+        snapshot->GetPageSize() != page_size ||
+        snapshot->GetNumPages() != flashSize / page_size)
+        return false;
+
+    // A rollback is the way back from a bad state, so every page is read back rather
+    // than trusting the manifest. The manifest is only kept up to date.
+    TwibootManifest manifest;
+    bool haveManifest = loadManifest(&manifest, signature, false);
+
+    WITH_TRANSPORT_LOCK(transport)
+    {
+        for (int page = 0; page < snapshot->GetNumPages(); page++)
+        {
+            uint8_t data[page_size];
+            uint8_t read[page_size];
+
+            if (!ReadFlashPage(read, page))
+                return false;
+
+            uint32_t current = pageHash(read, page_size);
+            bool inManifest = haveManifest && page >= manifest.first_page && page < manifest.first_page + manifest.num_pages;
+
+            if (inManifest && current != manifestHash(&manifest, page))
+            {
+                // Something else flashed the device since the manifest was written.
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    ClearManifest();
+                }
+                haveManifest = false;
+                inManifest = false;
+            }
+
+            if (current == snapshot->GetHash(page))
+                continue;
+
+            snapshot->GetPage(page, data);
+
+            if (!writePage(data, page) || !ReadFlashPage(read, page) || memcmp(read, data, page_size) != 0)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    ClearManifest(); // what the page holds now is unknown
+                }
+                return false;
+            }
+
+            if (inManifest)
+            {
+                WITHOUT_TRANSPORT_LOCK(transport)
+                {
+                    updateManifest(&manifest, page, data);
+                }
+            }
+
+            written++;
+        }
+    }
+
+    if (pagesWritten != nullptr)
+        *pagesWritten = written;
+
+    return true;
+}
+
+void Twiboot::ClearManifest()
+{
+    if (manifest_offset < 0)
+        return;
+
+    uint32_t magic = 0;
+    twibootStorageWrite(manifest_offset, &magic, sizeof(magic));
+}
+
+bool Twiboot::loadManifest(TwibootManifest *manifest, uint32_t signature, bool probe)
+{
+    if (manifest_offset < 0)
+        return false;
+
+    twibootStorageRead(manifest_offset, manifest, sizeof(TwibootManifest));
+
+    if (manifest->magic != TWIBOOT_MANIFEST_MAGIC ||
+        manifest->signature != signature ||
+        manifest->addr != addr ||
+        manifest->page_size != page_size ||
+        manifest->num_pages == 0 ||
+        manifest->num_pages > TWIBOOT_MANIFEST_MAX_PAGES)
+        return false;
+
+    if (!probe)
+        return true;
+
+    // Spot-check the first and last pages the manifest covers, to catch a device that
+    // was flashed by something else since the manifest was written.
+    uint16_t probes[2] = {manifest->first_page, (uint16_t)(manifest->first_page + manifest->num_pages - 1)};
+    for (int i = 0; i < 2; i++)
+    {
+        uint8_t read[page_size];
+
+        if (!ReadFlashPage(read, probes[i]) || pageHash(read, page_size) != manifestHash(manifest, probes[i]))
+        {
+            ClearManifest();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Twiboot::manifestFits(int numPages)
+{
+    return manifest_offset >= 0 && numPages <= TWIBOOT_MANIFEST_MAX_PAGES &&
+           manifest_offset + sizeof(TwibootManifest) + numPages * sizeof(uint32_t) <= twibootStorageLength();
+}
+
+bool Twiboot::writeManifestHash(int index, uint32_t hash)
+{
+    return twibootStorageWrite(manifest_offset + sizeof(TwibootManifest) + index * sizeof(uint32_t), &hash, sizeof(hash));
+}
+
+bool Twiboot::commitManifest(uint32_t signature, uint16_t firstPage, uint16_t numPages)
+{
+    TwibootManifest manifest = {
+        .magic = TWIBOOT_MANIFEST_MAGIC,
+        .signature = signature,
+        .addr = addr,
+        .page_size = page_size,
+        .first_page = firstPage,
+        .num_pages = numPages,
+    };
+
+    return twibootStorageWrite(manifest_offset, &manifest, sizeof(manifest));
+}
+
+bool Twiboot::saveManifest(uint32_t signature, uint8_t *buf, int len, uint16_t page)
+{
+    int numPages = NUM_PAGES_IN(len);
+
+    if (!manifestFits(numPages))
+        return false;
+
+    // Write the hashes first, so that a half-written manifest is never marked as valid.
+    ClearManifest();
+
+    for (int i = 0; i < numPages; i++)
+    {
+        uint8_t data[page_size];
+
+        padPage(data, buf, len, i, page_size);
+        if (!writeManifestHash(i, pageHash(data, page_size)))
+            return false; // leave the manifest marked as invalid
+    }
+
+    return commitManifest(signature, page, numPages);
+}
+
+uint32_t Twiboot::manifestHash(TwibootManifest *manifest, uint16_t page)
+{
+    uint32_t hash;
+    twibootStorageRead(manifest_offset + sizeof(TwibootManifest) + (page - manifest->first_page) * sizeof(uint32_t), &hash, sizeof(hash));
+    return hash;
+}
+
+void Twiboot::updateManifest(TwibootManifest *manifest, uint16_t page, uint8_t *data)
+{
+    if (!writeManifestHash(page - manifest->first_page, pageHash(data, page_size)))
+        ClearManifest(); // the old hash no longer matches the page
+}
+
+bool Twiboot::Exit()
+{
+    uint8_t cmd[2] = {0x01, 0x80};
+
+    if (!transport->Write(addr, cmd, 2))
+        return false;
+
+    transport->End();
+
+    return true;
+}
+
+bool Twiboot::BootApp()
+{
+    if (Exit())
+        return true;
+
+    if (reset_pin == PIN_INVALID)
+        return false;
+
+    // The bootloader starts the application by itself once its boot timeout runs out.
+    return resetDevice();
+}
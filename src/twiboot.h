@@ -2,8 +2,14 @@
 #define twiboot_h
 
 #include <inttypes.h>
-#include "Particle.h"
+#include "platform.h"
+#include "transport.h"
+#include "wire_transport.h"
+#include "linux_transport.h"
+#include "emulated_transport.h"
+#include "arbiter.h"
 #include "crc.h"
+#include "snapshot.h"
 
 /**
  * Helper macro to get the number of pages in the length of something.
@@ -13,13 +19,55 @@
 #define NUM_PAGES_IN(len) (((len % page_size) > 0) ? ((len / page_size) + 1) : (len / page_size))
 
 /**
- * Helper macro to automatically start the wire library.
+ * How long the RESET line is held low when resetting the device, in milliseconds.
  */
-#define START_WIRE         \
-    if (!Wire.isEnabled()) \
-    {                      \
-        Wire.begin();      \
-    }
+#define TWIBOOT_RESET_PULSE_MS 1
+
+/**
+ * How long to keep trying to catch the bootloader after a reset, in milliseconds.
+ * Must be shorter than the bootloader's own boot timeout (1000ms by default).
+ */
+#define TWIBOOT_ENTRY_WINDOW_MS 500
+
+/**
+ * How far ahead of the last measured entry time the next attempt starts sending
+ * the abort command, in milliseconds.
+ */
+#define TWIBOOT_ENTRY_MARGIN_MS 2
+
+/**
+ * Marks a valid manifest record in EEPROM ("TWMF").
+ */
+#define TWIBOOT_MANIFEST_MAGIC 0x544D5746
+
+/**
+ * The largest image, in pages, that a manifest can record.
+ */
+#define TWIBOOT_MANIFEST_MAX_PAGES 256
+
+/**
+ * The record of the last image flashed to a device, kept in EEPROM. It is followed
+ * by one 32-bit hash for each page of the image.
+ */
+struct TwibootManifest
+{
+    uint32_t magic;      // TWIBOOT_MANIFEST_MAGIC if the record is valid
+    uint32_t signature;  // The signature of the chip the image was flashed to
+    uint8_t addr;        // The address of the device the image was flashed to
+    uint8_t page_size;   // The size of a page in the device
+    uint16_t first_page; // The first page of the image
+    uint16_t num_pages;  // The number of pages in the image
+};
+
+/**
+ * A run of bytes to write into flash at any byte address, used by PatchFlash().
+ */
+struct TwibootPatch
+{
+    uint16_t addr; // The byte address in flash to start writing at
+    uint8_t *buf;  // The bytes to write
+    uint16_t len;  // The number of bytes to write
+};
 
 /**
  * The Twiboot class is a library for communicating with the Twiboot bootloader.
@@ -27,6 +75,7 @@
 class Twiboot
 {
 public:
+#if defined(PARTICLE)
     /**
      * Construct a new Twiboot object
      */
@@ -39,6 +88,24 @@ public:
      */
     Twiboot(uint8_t address);
 
+    /**
+     * Construct a new Twiboot object
+     *
+     * @param address The address of the Twiboot device.
+     * @param resetPin The GPIO pin wired to the device's RESET line.
+     */
+    Twiboot(uint8_t address, pin_t resetPin);
+#endif
+
+    /**
+     * Construct a new Twiboot object
+     *
+     * @param transport The bus the Twiboot device is on.
+     * @param address The address of the Twiboot device.
+     * @param resetPin The GPIO pin wired to the device's RESET line.
+     */
+    Twiboot(TwibootTransport *transport, uint8_t address = 0x29, pin_t resetPin = PIN_INVALID);
+
     /**
      * Initializes the Twiboot device. Stops the application from
      * automatically running and gets the device information (page size).
@@ -56,6 +123,24 @@ public:
      */
     inline bool AbortBootTimeout() { return Init(); };
 
+    /**
+     * Resets the device through the reset pin and catches the bootloader before it
+     * times out. The abort command is sent right after the reset, and entry is
+     * confirmed with the bootloader's version string. The time it took for the
+     * bootloader to answer is remembered, so later attempts start closer to it.
+     * Falls back to a single Init() if no reset pin was given.
+     *
+     * @param attempts The number of resets to try before giving up.
+     *
+     * @returns True if the device is in the bootloader. Otherwise, false.
+     */
+    bool EnterBootloader(uint8_t attempts = 3);
+
+    /**
+     * Gets how long the last successful EnterBootloader() took, in milliseconds.
+     */
+    inline uint32_t GetEntryLatency() { return entry_latency; };
+
     /**
      * Gets the version of the bootloader.
      *
@@ -143,6 +228,105 @@ public:
      */
     inline void Flash(uint8_t *buf, int len) { WriteFlash(buf, len); }
 
+    /**
+     * Flashes only the pages of a buffer that differ from what the device holds.
+     * What the device holds is looked up in the manifest of the last image flashed
+     * with this function, so unchanged pages cost nothing on the bus. Pages that the
+     * manifest does not cover (or all pages, if there is no manifest for this device)
+     * are read back and compared instead. Every page written is read back to verify
+     * it. If the manifest already covers the image, the hashes of the pages written
+     * are updated in place; otherwise, the manifest is replaced with the new image
+     * once all pages are written.
+     *
+     * Before the manifest is trusted, its first and last pages are read back and
+     * checked; if either differs, the whole image is read back instead. Changes
+     * elsewhere on the device can't be seen this way, so call ClearManifest() if
+     * Verify() fails afterwards.
+     *
+     * @param buf The data to write.
+     * @param len The length of the buffer
+     * @param page The page to write to (zero-indexed).
+     * @param pagesWritten Where to store the number of pages that were written. May be nullptr.
+     *
+     * @returns True if the operation was successful. Otherwise, false.
+     */
+    bool WriteFlashDelta(uint8_t *buf, int len, uint16_t page = 0, int *pagesWritten = nullptr);
+
+    /**
+     * Writes bytes into flash at any byte address, keeping the rest of the pages they
+     * fall in. Each page touched is read, the new bytes are merged into it, and it is
+     * only written (and read back to verify) if the merged page differs from what
+     * the device already holds. The manifest is kept up to date with the new pages.
+     *
+     * @param byteAddr The byte address in flash to start writing at.
+     * @param buf The bytes to write.
+     * @param len The number of bytes to write.
+     * @param pagesWritten Where to store the number of pages that were written, even if the
+     *        operation fails partway. May be nullptr.
+     *
+     * @returns True if the operation was successful. Otherwise, false.
+     */
+    inline bool PatchFlash(uint16_t byteAddr, uint8_t *buf, uint16_t len, int *pagesWritten = nullptr)
+    {
+        TwibootPatch patch = {byteAddr, buf, len};
+        return PatchFlash(&patch, 1, pagesWritten);
+    };
+
+    /**
+     * Writes a list of patches into flash at once. Patches that fall in the same page
+     * are merged, so each page is read and written at most once.
+     *
+     * @param patches The patches to write. Later patches win where they overlap.
+     * @param count The number of patches.
+     * @param pagesWritten Where to store the number of pages that were written, even if the
+     *        operation fails partway. May be nullptr.
+     *
+     * @returns True if the operation was successful. Otherwise, false. Nothing is written if
+     *          any patch runs past the end of the application section.
+     */
+    bool PatchFlash(TwibootPatch *patches, int count, int *pagesWritten = nullptr);
+
+    /**
+     * Copies the whole application section of the device's flash into a snapshot,
+     * reading the pages back to back. Erased pages are only marked as empty. If a
+     * manifest is kept, it is replaced with one covering the whole section, which
+     * WriteFlashDelta(), PatchFlash() and Rollback() then keep up to date.
+     *
+     * @param snapshot The snapshot to store the flash in. Anything in it is cleared.
+     *
+     * @returns True if the operation was successful. Otherwise, false.
+     */
+    bool Snapshot(TwibootSnapshot *snapshot);
+
+    /**
+     * Restores the device's flash from a snapshot, writing only the pages that
+     * differ from it. Snapshots taken from another chip or address are refused.
+     * Every page is read back and its hash compared with the snapshot, so a rollback
+     * also repairs changes the manifest doesn't know about. Each page written is read
+     * back again to verify it, and the manifest is kept up to date.
+     *
+     * @param snapshot The snapshot to restore.
+     * @param pagesWritten Where to store the number of pages that were written. May be nullptr.
+     *
+     * @returns True if the operation was successful. Otherwise, false.
+     */
+    bool Rollback(TwibootSnapshot *snapshot, int *pagesWritten = nullptr);
+
+    /**
+     * Sets where in EEPROM the manifest of the last image flashed is kept. Each device
+     * needs its own region of TWIBOOT_MANIFEST_MAX_PAGES * 4 bytes, plus the header.
+     * The manifest is not used until this is called.
+     *
+     * @param offset The EEPROM address of the manifest, or -1 to not keep one.
+     */
+    inline void SetManifestOffset(int offset) { manifest_offset = offset; };
+
+    /**
+     * Forgets the last image flashed, for example after the device was flashed by
+     * something else. The next WriteFlashDelta() reads the device back instead.
+     */
+    void ClearManifest();
+
     /**
      * Verifies that the device contains the same data as the buffer.
      * Uses the CRC16 standard to verify the data.
@@ -157,7 +341,7 @@ public:
 
     /**
      * Exits the bootloader and starts the application.
-     * Automatically lets go of the Wire buffer
+     * Automatically lets go of the bus
      *
      * @returns True if the operation was successful. Otherwise, false.
      */
@@ -166,28 +350,39 @@ public:
     /**
      * DEPRECEATED: Use Exit instead.
      * Starts the main (non-bootloader) application on the device. Automatically
-     * lets go of the Wire buffer.
+     * lets go of the bus.
      */
     inline void JumpToApp() { Exit(); };
 
+    /**
+     * Starts the application. If the bootloader does not take the Exit() command,
+     * the device is reset through the reset pin instead, and the bootloader starts
+     * the application once it times out.
+     *
+     * @returns True if the application is starting. Otherwise, false.
+     */
+    bool BootApp();
+
 private:
-    uint8_t addr;      // The address of the twiboot device
-    uint8_t page_size; // The size of a page in the device
-};
+    TwibootTransport *transport; // The bus the twiboot device is on
+    uint8_t addr;                // The address of the twiboot device
+    uint8_t page_size;           // The size of a page in the device
+    pin_t reset_pin;             // The pin wired to the device's RESET line, or PIN_INVALID
+    uint16_t entry_delay;        // How long to wait after a reset before sending the abort command
+    uint32_t entry_latency;      // How long the last successful EnterBootloader() took
+    int manifest_offset;         // Where the manifest is kept in EEPROM, or -1
 
-/* Need to include this to increase TWI/I2C buffer size */
-#define TWI_BUFFER_SIZE 140
+    bool abortBootTimeout();                      // Sends the abort command (0x00) to the bootloader
+    bool resetDevice();                           // Pulses the device's RESET line
+    bool writePage(uint8_t *data, uint16_t page); // Writes a single full page
 
-hal_i2c_config_t acquireWireBuffer()
-{
-    hal_i2c_config_t config = {
-        .size = sizeof(hal_i2c_config_t),
-        .version = HAL_I2C_CONFIG_VERSION_1,
-        .rx_buffer = new (std::nothrow) uint8_t[TWI_BUFFER_SIZE],
-        .rx_buffer_size = TWI_BUFFER_SIZE,
-        .tx_buffer = new (std::nothrow) uint8_t[TWI_BUFFER_SIZE],
-        .tx_buffer_size = TWI_BUFFER_SIZE};
-    return config;
-}
+    bool loadManifest(TwibootManifest *manifest, uint32_t signature, bool probe = true); // Reads the manifest, if it is valid for this device
+    bool saveManifest(uint32_t signature, uint8_t *buf, int len, uint16_t page);         // Records an image as the last one flashed
+    bool manifestFits(int numPages);                                                     // Whether a manifest of this many pages fits in EEPROM
+    bool writeManifestHash(int index, uint32_t hash);                                    // Stores the hash of one page of the manifest
+    bool commitManifest(uint32_t signature, uint16_t firstPage, uint16_t numPages);      // Writes the header, marking the manifest as valid
+    uint32_t manifestHash(TwibootManifest *manifest, uint16_t page);                     // Reads the hash of a page from the manifest
+    void updateManifest(TwibootManifest *manifest, uint16_t page, uint8_t *data);        // Replaces the hash of a page in the manifest
+};
 
 #endif // twiboot_h
\ No newline at end of file
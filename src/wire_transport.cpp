@@ -0,0 +1,62 @@
+#include "wire_transport.h"
+
+#if defined(PARTICLE)
+
+bool TwibootWireTransport::Begin()
+{
+    START_WIRE;
+    return true;
+}
+
+void TwibootWireTransport::End()
+{
+    Wire.end();
+}
+
+bool TwibootWireTransport::Write(uint8_t addr, const uint8_t *buf, size_t len)
+{
+    WITH_LOCK(Wire)
+    {
+        Wire.beginTransmission(addr);
+        Wire.write(buf, len);
+        if (Wire.endTransmission() != 0) // if there are any errors, return false. Otherwise, return true.
+            return false;
+    }
+
+    return true;
+}
+
+bool TwibootWireTransport::WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen)
+{
+    WITH_LOCK(Wire)
+    {
+        Wire.beginTransmission(addr);
+        Wire.write(wbuf, wlen);
+        if (Wire.endTransmission(false) != 0) // no STOP, so the read goes out with a repeated START
+            return false;
+
+        if (Wire.requestFrom(addr, rlen) != rlen)
+            return false;
+
+        for (size_t i = 0; i < rlen; i++)
+        {
+            rbuf[i] = Wire.read();
+        }
+    }
+
+    return true;
+}
+
+hal_i2c_config_t acquireWireBuffer()
+{
+    hal_i2c_config_t config = {
+        .size = sizeof(hal_i2c_config_t),
+        .version = HAL_I2C_CONFIG_VERSION_1,
+        .rx_buffer = new (std::nothrow) uint8_t[TWI_BUFFER_SIZE],
+        .rx_buffer_size = TWI_BUFFER_SIZE,
+        .tx_buffer = new (std::nothrow) uint8_t[TWI_BUFFER_SIZE],
+        .tx_buffer_size = TWI_BUFFER_SIZE};
+    return config;
+}
+
+#endif // PARTICLE
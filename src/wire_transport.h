@@ -0,0 +1,37 @@
+#ifndef wire_transport_h
+#define wire_transport_h
+
+#if defined(PARTICLE)
+
+#include "Particle.h"
+#include "transport.h"
+
+/**
+ * Helper macro to automatically start the wire library.
+ */
+#define START_WIRE         \
+    if (!Wire.isEnabled()) \
+    {                      \
+        Wire.begin();      \
+    }
+
+/* Need to include this to increase TWI/I2C buffer size */
+#define TWI_BUFFER_SIZE 140
+
+/**
+ * A transport over the Particle Wire library.
+ */
+class TwibootWireTransport : public TwibootTransport
+{
+public:
+    bool Begin() override;
+    void End() override;
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override;
+    bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) override;
+    inline void lock() override { Wire.lock(); };
+    inline void unlock() override { Wire.unlock(); };
+};
+
+#endif // PARTICLE
+
+#endif // wire_transport_h
@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "twiboot.h"
+
+#if defined(__linux__)
+#include <linux/i2c.h>
+#endif
+
+/*
+ * Runs the library against an emulated twiboot device on the host.
+ *
+ * Usage: make -C test
+ */
+
+static int failures = 0;
+
+// Where the tests keep the manifest, instead of twiboot.eeprom.
+#define STORAGE_FILE "host_test.eeprom"
+
+#define CHECK(cond)                                                            \
+    if (!(cond))                                                               \
+    {                                                                          \
+        fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond);     \
+        failures++;                                                            \
+    }
+
+/*
+ * Forgets every manifest written by an earlier test.
+ */
+static void freshStorage()
+{
+    unlink(STORAGE_FILE);
+}
+
+/*
+ * An emulated device whose flash page writes can be made to fail.
+ */
+class FailingTransport : public TwibootEmulatedTransport
+{
+public:
+    bool fail_writes = false; // Whether flash page writes fail
+
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override
+    {
+        if (fail_writes && len > 4 && buf[0] == 0x02 && buf[1] == 0x01)
+            return false;
+
+        return TwibootEmulatedTransport::Write(addr, buf, len);
+    }
+};
+
+static void testInit()
+{
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+
+    CHECK(twiboot.Init());
+
+    char version[16];
+    CHECK(twiboot.GetBootloaderVersion(version));
+    CHECK(strncmp(version, "TWIBOOT", 7) == 0);
+
+    uint64_t signature;
+    uint8_t pageSize;
+    uint16_t flashSize;
+    uint16_t eepromSize;
+    CHECK(twiboot.GetChipInfo(&signature, &pageSize, &flashSize, &eepromSize));
+    CHECK(signature == 0x1E950F);
+    CHECK(pageSize == 128);
+    CHECK(flashSize == 0x7C00);
+    CHECK(eepromSize == 1024);
+}
+
+static void testWrongAddress()
+{
+    TwibootEmulatedTransport bus(0x29);
+    Twiboot twiboot(&bus, 0x30);
+
+    CHECK(!twiboot.Init());
+}
+
+static void testWriteAndVerify()
+{
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[300];
+    for (int i = 0; i < 300; i++)
+    {
+        prog[i] = i * 7;
+    }
+
+    CHECK(twiboot.WriteFlash(prog, sizeof(prog)));
+    CHECK(bus.GetPageWrites() == 3);
+    CHECK(twiboot.Verify(prog, sizeof(prog)));
+
+    // The last page is padded with 0xFF past the end of the buffer.
+    uint8_t page[128];
+    CHECK(twiboot.ReadFlashPage(page, 2));
+    CHECK(memcmp(page, &prog[256], 44) == 0);
+    CHECK(page[44] == 0xFF && page[127] == 0xFF);
+
+    // A byte changed behind the library's back fails verification.
+    bus.GetFlash()[130] ^= 0x01;
+    CHECK(!twiboot.Verify(prog, sizeof(prog)));
+}
+
+static void testWriteAtPage()
+{
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[128];
+    memset(prog, 0x5A, sizeof(prog));
+
+    CHECK(twiboot.WriteFlash(prog, sizeof(prog), 10));
+    CHECK(twiboot.Verify(prog, sizeof(prog), 10));
+    CHECK(bus.GetFlash()[10 * 128] == 0x5A);
+    CHECK(bus.GetFlash()[9 * 128] == 0xFF);
+}
+
+static void testExit()
+{
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    CHECK(twiboot.Exit());
+    CHECK(bus.IsRunningApp());
+    CHECK(!twiboot.Init());
+
+    bus.Reset();
+    CHECK(twiboot.Init());
+}
+
+static void testWriteFlashDelta()
+{
+    freshStorage();
+
+    FailingTransport bus;
+    Twiboot twiboot(&bus);
+    twiboot.SetManifestOffset(0);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[10 * 128];
+    for (int i = 0; i < (int)sizeof(prog); i++)
+    {
+        prog[i] = i * 13 + 1;
+    }
+
+    // Without a manifest, every page is read back, and all of them differ.
+    int written = -1;
+    uint32_t reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 10);
+    CHECK(bus.GetPageWrites() == 10);
+    CHECK(bus.GetFlashReads() - reads == 10 + 10);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // With the manifest, only the first and last pages are read to check it, plus each
+    // page written to verify it.
+    prog[3 * 128 + 5] ^= 0xFF;
+    prog[7 * 128 + 9] ^= 0xFF;
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 2);
+    CHECK(bus.GetPageWrites() == 12);
+    CHECK(bus.GetFlashReads() - reads == 4);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // A first page changed behind the library's back clears the manifest, so the whole
+    // image is read back and the page is repaired.
+    bus.GetFlash()[0] ^= 0x01;
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 1);
+    CHECK(bus.GetFlashReads() - reads == 1 + 10 + 1);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // The same goes for the last page.
+    bus.GetFlash()[9 * 128 + 100] ^= 0x01;
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 1);
+    CHECK(bus.GetFlashReads() - reads == 2 + 10 + 1);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // A failed write forgets the manifest, since what the page holds is unknown.
+    prog[4 * 128] ^= 0xFF;
+    bus.fail_writes = true;
+    CHECK(!twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    bus.fail_writes = false;
+
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 1);
+    CHECK(bus.GetFlashReads() - reads == 10 + 1);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // Without a manifest offset, every page is always read back.
+    twiboot.SetManifestOffset(-1);
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetFlashReads() - reads == 10);
+}
+
+static void testPatchFlash()
+{
+    freshStorage();
+
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    uint8_t erased[0x7C00];
+    memset(erased, 0xFF, sizeof(erased));
+
+    // A patch across a page boundary writes both pages and keeps the bytes around it.
+    uint8_t patch[16];
+    memset(patch, 0x11, sizeof(patch));
+    int written = -1;
+    CHECK(twiboot.PatchFlash(120, patch, sizeof(patch), &written));
+    CHECK(written == 2);
+    CHECK(bus.GetPageWrites() == 2);
+    CHECK(memcmp(&bus.GetFlash()[120], patch, sizeof(patch)) == 0);
+    CHECK(memcmp(bus.GetFlash(), erased, 120) == 0);
+    CHECK(memcmp(&bus.GetFlash()[136], erased, 256 - 136) == 0);
+
+    // Where patches overlap, the later one wins.
+    uint8_t a[8];
+    uint8_t b[4];
+    memset(a, 0xAA, sizeof(a));
+    memset(b, 0xBB, sizeof(b));
+    TwibootPatch overlapping[2] = {{300, a, sizeof(a)}, {304, b, sizeof(b)}};
+    CHECK(twiboot.PatchFlash(overlapping, 2, &written));
+    CHECK(written == 1);
+    CHECK(memcmp(&bus.GetFlash()[300], a, 4) == 0);
+    CHECK(memcmp(&bus.GetFlash()[304], b, 4) == 0);
+
+    // Patching in the bytes already there writes nothing.
+    CHECK(twiboot.PatchFlash(overlapping, 2, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetPageWrites() == 3);
+
+    // Empty patches and empty lists don't touch the bus.
+    uint32_t reads = bus.GetFlashReads();
+    CHECK(twiboot.PatchFlash(100, patch, 0, &written));
+    CHECK(written == 0);
+    CHECK(twiboot.PatchFlash(nullptr, 0, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetFlashReads() == reads);
+
+    // A patch running past the end of the application section writes nothing at all,
+    // even where other patches in the batch are in range.
+    CHECK(!twiboot.PatchFlash(0x7BF8, patch, sizeof(patch), &written));
+    CHECK(written == 0);
+    TwibootPatch outOfRange[2] = {{0x10, a, 4}, {0xFFF0, patch, sizeof(patch)}};
+    written = -1;
+    CHECK(!twiboot.PatchFlash(outOfRange, 2, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetPageWrites() == 3);
+    CHECK(bus.GetFlash()[0x10] == 0xFF);
+    CHECK(bus.GetFlash()[0x7BF8] == 0xFF);
+}
+
+static void testPatchFlashManifest()
+{
+    freshStorage();
+
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    twiboot.SetManifestOffset(0);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[10 * 128];
+    memset(prog, 0x42, sizeof(prog));
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog)));
+
+    // Only the patched page is read, and read back once written; the manifest is not
+    // spot-checked, and it is kept up to date.
+    uint8_t patch[4] = {1, 2, 3, 4};
+    uint32_t reads = bus.GetFlashReads();
+    int written = -1;
+    CHECK(twiboot.PatchFlash(5 * 128 + 10, patch, sizeof(patch), &written));
+    CHECK(written == 1);
+    CHECK(bus.GetFlashReads() - reads == 2);
+
+    memcpy(&prog[5 * 128 + 10], patch, sizeof(patch));
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetFlashReads() - reads == 2);
+
+    // A patched page that was changed behind the library's back clears the manifest.
+    bus.GetFlash()[2 * 128] ^= 0x01;
+    CHECK(twiboot.PatchFlash(2 * 128 + 1, patch, sizeof(patch), &written));
+    CHECK(written == 1);
+
+    prog[2 * 128] ^= 0x01;
+    memcpy(&prog[2 * 128 + 1], patch, sizeof(patch));
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(prog, sizeof(prog), 0, &written));
+    CHECK(written == 0);
+    CHECK(bus.GetFlashReads() - reads == 10);
+}
+
+static void testSnapshot()
+{
+    freshStorage();
+
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[3 * 128];
+    memset(prog, 0x24, sizeof(prog));
+    CHECK(twiboot.WriteFlash(prog, sizeof(prog), 100));
+
+    // Only the three programmed pages take up space; the erased ones are only marked.
+    TwibootSnapshot snapshot;
+    uint32_t reads = bus.GetFlashReads();
+    CHECK(twiboot.Snapshot(&snapshot));
+    CHECK(bus.GetFlashReads() - reads == 248);
+    CHECK(snapshot.GetNumPages() == 248);
+    CHECK(snapshot.GetDataSize() == 3 * 128);
+    CHECK(snapshot.IsEmpty(0) && snapshot.IsEmpty(99) && snapshot.IsEmpty(103));
+    CHECK(!snapshot.IsEmpty(100) && !snapshot.IsEmpty(102));
+
+    uint8_t page[128];
+    snapshot.GetPage(101, page);
+    CHECK(memcmp(page, prog, sizeof(page)) == 0);
+    snapshot.GetPage(0, page);
+    CHECK(page[0] == 0xFF && page[127] == 0xFF);
+}
+
+static void testRollback()
+{
+    freshStorage();
+
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    twiboot.SetManifestOffset(0);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[248 * 128];
+    for (int i = 0; i < (int)sizeof(prog); i++)
+    {
+        prog[i] = i * 7 + i / 128;
+    }
+    CHECK(twiboot.WriteFlash(prog, sizeof(prog)));
+
+    TwibootSnapshot snapshot;
+    CHECK(twiboot.Snapshot(&snapshot));
+
+    // The snapshot seeds a manifest of the whole flash, so a 16-page update only reads
+    // the two pages the manifest is checked with, plus the 16 it writes: 18 reads
+    // instead of one per page of the image.
+    uint8_t update[16 * 128];
+    memset(update, 0x5A, sizeof(update));
+    int written = -1;
+    uint32_t reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(update, sizeof(update), 40, &written));
+    CHECK(written == 16);
+    CHECK(bus.GetFlashReads() - reads == 18);
+
+    // Rolling back reads every page, but only writes the 16 that changed.
+    uint32_t writes = bus.GetPageWrites();
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.Rollback(&snapshot, &written));
+    CHECK(written == 16);
+    CHECK(bus.GetPageWrites() - writes == 16);
+    CHECK(bus.GetFlashReads() - reads == 248 + 16);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // A page changed behind the library's back, which the manifest can't know about,
+    // is still found and restored, and the manifest is forgotten.
+    bus.GetFlash()[5 * 128 + 77] ^= 0x01;
+    CHECK(twiboot.Rollback(&snapshot, &written));
+    CHECK(written == 1);
+    CHECK(memcmp(bus.GetFlash(), prog, sizeof(prog)) == 0);
+
+    reads = bus.GetFlashReads();
+    CHECK(twiboot.WriteFlashDelta(update, sizeof(update), 40, &written));
+    CHECK(written == 16);
+    CHECK(bus.GetFlashReads() - reads == 16 + 16);
+}
+
+static void testRollbackForeignDevice()
+{
+    TwibootEmulatedTransport bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    TwibootSnapshot snapshot;
+    CHECK(twiboot.Snapshot(&snapshot));
+
+    // Another chip, another address and another page size are all refused untouched.
+    TwibootEmulatedTransport otherChip(0x29, 0x1E9514);
+    Twiboot onOtherChip(&otherChip);
+    CHECK(!onOtherChip.Rollback(&snapshot));
+    CHECK(otherChip.GetPageWrites() == 0);
+
+    TwibootEmulatedTransport otherAddress(0x30);
+    Twiboot atOtherAddress(&otherAddress, 0x30);
+    CHECK(!atOtherAddress.Rollback(&snapshot));
+    CHECK(otherAddress.GetPageWrites() == 0);
+
+    TwibootEmulatedTransport otherPages(0x29, 0x1E950F, 64);
+    Twiboot withOtherPages(&otherPages);
+    CHECK(!withOtherPages.Rollback(&snapshot));
+    CHECK(otherPages.GetPageWrites() == 0);
+
+    CHECK(twiboot.Rollback(&snapshot));
+}
+
+/*
+ * An emulated device on a bus where every transaction takes a millisecond, which
+ * records which thread made each transaction.
+ */
+class SlowTransport : public TwibootEmulatedTransport
+{
+public:
+    bool Write(uint8_t addr, const uint8_t *buf, size_t len) override
+    {
+        record();
+        return TwibootEmulatedTransport::Write(addr, buf, len);
+    }
+
+    bool WriteRead(uint8_t addr, const uint8_t *wbuf, size_t wlen, uint8_t *rbuf, size_t rlen) override
+    {
+        record();
+        return TwibootEmulatedTransport::WriteRead(addr, wbuf, wlen, rbuf, rlen);
+    }
+
+    // How many times the bus went from one of the threads to the other.
+    int GetSwitches(std::thread::id a, std::thread::id b)
+    {
+        int switches = 0;
+        std::thread::id last;
+
+        for (std::thread::id id : history)
+        {
+            if (id != a && id != b)
+                continue;
+
+            if (id != last && last != std::thread::id())
+                switches++;
+
+            last = id;
+        }
+
+        return switches;
+    }
+
+private:
+    std::vector<std::thread::id> history; // The thread of every transaction, in order
+
+    void record()
+    {
+        history.push_back(std::this_thread::get_id());
+        twibootDelay(1);
+    }
+};
+
+static void testArbiter()
+{
+    SlowTransport bus;
+    TwibootArbiter arbiter(&bus);
+    TwibootArbiterClient bulk1(&arbiter, TWIBOOT_PRIORITY_BULK);
+    TwibootArbiterClient bulk2(&arbiter, TWIBOOT_PRIORITY_BULK);
+    TwibootArbiterClient sensor(&arbiter, TWIBOOT_PRIORITY_HIGH);
+    Twiboot twiboot1(&bulk1);
+    Twiboot twiboot2(&bulk2);
+    CHECK(twiboot1.Init());
+
+    // Two whole-flash snapshots compete for the bus while a high-priority client polls.
+    std::atomic<bool> done(false);
+    std::thread polling([&]
+                        {
+                            uint8_t cmd = 0x01;
+                            uint8_t version[16];
+
+                            while (!done)
+                            {
+                                sensor.WriteRead(0x29, &cmd, 1, version, sizeof(version));
+                                twibootDelay(2);
+                            } });
+
+    arbiter.ResetStats();
+
+    bool ok1 = false;
+    bool ok2 = false;
+    std::thread flashing1([&]
+                          {
+                              TwibootSnapshot snapshot;
+                              ok1 = twiboot1.Snapshot(&snapshot); });
+    std::thread flashing2([&]
+                          {
+                              TwibootSnapshot snapshot;
+                              ok2 = twiboot2.Snapshot(&snapshot); });
+    std::thread::id id1 = flashing1.get_id();
+    std::thread::id id2 = flashing2.get_id();
+
+    flashing1.join();
+    flashing2.join();
+    done = true;
+    polling.join();
+
+    CHECK(ok1 && ok2);
+
+    // The high-priority client only ever waits for the transaction in flight (1 ms),
+    // plus the time to wake up; 10 ms leaves room for a loaded machine.
+    TwibootWaitStats high;
+    arbiter.GetStats(TWIBOOT_PRIORITY_HIGH, &high);
+    CHECK(high.count > 0);
+    CHECK(high.max_us < 10000);
+
+    // Each snapshot takes about 250 ms, so with 50 ms slices the bulk clients take turns.
+    CHECK(bus.GetSwitches(id1, id2) >= 4);
+}
+
+#if defined(__linux__)
+
+/*
+ * A Linux transport whose I2C_RDWR transfers go to an emulated device instead of the
+ * kernel, checking that the messages are laid out the way the kernel expects.
+ */
+class EmulatedI2cDev : public TwibootLinuxTransport
+{
+public:
+    EmulatedI2cDev() : TwibootLinuxTransport("/dev/null") { short_transfers = false; }
+
+    TwibootEmulatedTransport device;
+    bool short_transfers; // Whether to report one message fewer than was transferred
+
+protected:
+    int transfer(struct i2c_msg *msgs, int count) override
+    {
+        bool ok;
+
+        if (count == 1 && msgs[0].flags == 0)
+        {
+            ok = device.Write(msgs[0].addr, msgs[0].buf, msgs[0].len);
+        }
+        else if (count == 2 && msgs[0].flags == 0 && msgs[1].flags == I2C_M_RD && msgs[0].addr == msgs[1].addr)
+        {
+            ok = device.WriteRead(msgs[0].addr, msgs[0].buf, msgs[0].len, msgs[1].buf, msgs[1].len);
+        }
+        else
+        {
+            return -1;
+        }
+
+        if (!ok)
+            return -1;
+
+        return short_transfers ? count - 1 : count;
+    }
+};
+
+static void testLinuxTransport()
+{
+    EmulatedI2cDev bus;
+    Twiboot twiboot(&bus);
+    CHECK(twiboot.Init());
+
+    uint8_t prog[200];
+    for (int i = 0; i < 200; i++)
+    {
+        prog[i] = i ^ 0xA5;
+    }
+
+    CHECK(twiboot.WriteFlash(prog, sizeof(prog)));
+    CHECK(twiboot.Verify(prog, sizeof(prog)));
+    CHECK(memcmp(bus.device.GetFlash(), prog, sizeof(prog)) == 0);
+
+    // A transfer that didn't get through every message counts as failed.
+    bus.short_transfers = true;
+    CHECK(!twiboot.Init());
+    CHECK(!twiboot.Exit());
+
+    // The device path is copied, so the caller's buffer may go away.
+    char path[] = "/dev/null";
+    TwibootLinuxTransport null(path);
+    memset(path, 0, sizeof(path));
+    CHECK(null.Begin());
+    null.End();
+}
+
+#endif // __linux__
+
+int main()
+{
+    setenv("TWIBOOT_STORAGE", STORAGE_FILE, 1);
+
+    testInit();
+    testWrongAddress();
+    testWriteAndVerify();
+    testWriteAtPage();
+    testExit();
+    testWriteFlashDelta();
+    testPatchFlash();
+    testPatchFlashManifest();
+    testSnapshot();
+    testRollback();
+    testRollbackForeignDevice();
+    testArbiter();
+#if defined(__linux__)
+    testLinuxTransport();
+#endif
+
+    freshStorage();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed\n");
+    return 0;
+}